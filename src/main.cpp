@@ -11,7 +11,13 @@ extern "C" {
     #include <lualib.h>
 }
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
 
 static void stackDump (lua_State *L, bool verbose=false) {
     int i;
@@ -122,10 +128,231 @@ void getRotation(lua_State* L, PyObject* parent, char* name){
     lua_setfield(L, -2, name);
 }
 
+void getPhysics(lua_State* L, PyObject* parent, char* name){
+    PyObject* physics = PyObject_GetAttrString(parent, name);
+    lua_newtable(L);
+    // stack: [..., {table parent}, {table physics}]
+    getVector(L, physics, (char*)"location");
+    getVector(L, physics, (char*)"velocity");
+    getVector(L, physics, (char*)"angular_velocity");
+    getRotation(L, physics, (char*)"rotation");
+    Py_DECREF(physics);
+    lua_setfield(L, -2, name);
+    // stack: [..., {table parent}]
+}
+
+void getLatestTouch(lua_State* L, PyObject* ball){
+    lua_newtable(L);
+    PyObject* last_touch = PyObject_GetAttrString(ball, "latest_touch");
+    // stack: [..., {table ball}, {table last_touch}]
+    getString(L, last_touch, (char*)"player_name");
+    getDouble(L, last_touch, (char*)"time_seconds");
+    getInt(L, last_touch, (char*)"team");
+    getInt(L, last_touch, (char*)"player_index");
+    getVector(L, last_touch, (char*)"hit_location");
+    getVector(L, last_touch, (char*)"hit_normal");
+    Py_DECREF(last_touch);
+    lua_setfield(L, -2, "latest_touch");
+    // stack: [..., {table ball}]
+}
+
+void getDropShotInfo(lua_State* L, PyObject* ball){
+    lua_newtable(L);
+    PyObject* dropshot_info = PyObject_GetAttrString(ball, "drop_shot_info");
+    // stack: [..., {table ball}, {table dropshot}]
+    getInt(L, dropshot_info, (char*)"damage_index");
+    getInt(L, dropshot_info, (char*)"absorbed_force");
+    getInt(L, dropshot_info, (char*)"force_accum_recent");
+    Py_DECREF(dropshot_info);
+    lua_setfield(L, -2, "drop_shot_info");
+    // stack: [..., {table ball}]
+}
+
+void getCollisionShape(lua_State* L, PyObject* ball){
+    lua_newtable(L);
+    PyObject* collision = PyObject_GetAttrString(ball, "collision_shape");
+    // stack: [..., {table ball}, {table collision}]
+    getInt(L, collision, (char*)"type");
+
+    lua_newtable(L);
+    // stack: [..., {table ball}, {table collision}, {table box}]
+    PyObject* box = PyObject_GetAttrString(collision, (char*)"box");
+    getDouble(L, box, (char*)"length");
+    getDouble(L, box, (char*)"width");
+    getDouble(L, box, (char*)"height");
+    Py_DECREF(box);
+    lua_setfield(L, -2, "box");
+
+    lua_newtable(L);
+    // stack: [..., {table ball}, {table collision}, {table sphere}]
+    PyObject* sphere = PyObject_GetAttrString(collision, (char*)"sphere");
+    getDouble(L, sphere, (char*)"diameter");
+    Py_DECREF(sphere);
+    lua_setfield(L, -2, "sphere");
+
+    lua_newtable(L);
+    // stack: [..., {table ball}, {table collision}, {table cylinder}]
+    PyObject* cylinder = PyObject_GetAttrString(collision, (char*)"cylinder");
+    getDouble(L, cylinder, (char*)"diameter");
+    getDouble(L, cylinder, (char*)"height");
+    Py_DECREF(cylinder);
+    lua_setfield(L, -2, "cylinder");
+    // stack: [..., {table ball}, {table collision}]
+
+    Py_DECREF(collision);
+    lua_setfield(L, -2, "collision_shape");
+    // stack: [..., {table ball}]
+}
+
+void pushCar(lua_State* L, PyObject* car){
+    lua_newtable(L);
+    // stack: [..., {table car}]
+    getPhysics(L, car, (char*)"physics");
+
+    char* bool_keys[] = {
+            (char*)"is_demolished",
+            (char*)"has_wheel_contact",
+            (char*)"is_super_sonic",
+            (char*)"is_bot",
+            (char*)"jumped",
+            (char*)"double_jumped"
+    };
+    for (char* key : bool_keys){
+        getBool(L, car, key);
+    }
+
+    getString(L, car, (char*)"name");
+    getInt(L, car, (char*)"team");
+    getDouble(L, car, (char*)"boost");
+
+    lua_newtable(L);
+    PyObject* hitbox = PyObject_GetAttrString(car, "hitbox");
+    // stack: [..., {table car}, {table hitbox}]
+    getInt(L, hitbox, (char*)"length");
+    getInt(L, hitbox, (char*)"width");
+    getInt(L, hitbox, (char*)"height");
+    Py_DECREF(hitbox);
+    lua_setfield(L, -2, "hitbox");
+    // stack: [..., {table car}]
+}
+
+void pushBoost(lua_State* L, PyObject* boost){
+    lua_newtable(L);
+    // stack: [..., {table boost}]
+    getBool(L, boost, (char*)"is_active");
+    getDouble(L, boost, (char*)"timer");
+}
+
+void pushTeam(lua_State* L, PyObject* team){
+    lua_newtable(L);
+    // stack: [..., {table team}]
+    getInt(L, team, (char*)"team_index");
+    getInt(L, team, (char*)"score");
+}
+
+void pushGameInfo(lua_State* L, PyObject* game_info){
+    lua_newtable(L);
+    // stack: [..., {table game_info}]
+    getDouble(L, game_info, (char*)"seconds_elapsed");
+    getDouble(L, game_info, (char*)"game_time_remaining");
+    getDouble(L, game_info, (char*)"world_gravity_z");
+    getDouble(L, game_info, (char*)"game_speed");
+    getBool(L, game_info, (char*)"is_overtime");
+    getBool(L, game_info, (char*)"is_unlimited_time");
+    getBool(L, game_info, (char*)"is_round_active");
+    getBool(L, game_info, (char*)"is_kickoff_pause");
+    getBool(L, game_info, (char*)"is_match_ended");
+}
+
+long getLength(PyObject* parent, const char* name){
+    PyObject* prop = PyObject_GetAttrString(parent, name);
+    long x = PyLong_AsLong(prop);
+    Py_DECREF(prop);
+    return x;
+}
+
+// Pushes a table of num_name raw objects converted from the list_name attribute of packet
+void getList(lua_State* L, PyObject* packet, const char* list_name, const char* num_name, void (*push)(lua_State*, PyObject*)){
+    long num = getLength(packet, num_name);
+    lua_pushinteger(L, num);
+    lua_setfield(L, -2, num_name);
+
+    PyObject* list = PyObject_GetAttrString(packet, list_name);
+    lua_newtable(L);
+    // stack: [..., {table packet}, {table list}]
+    for (long i = 0; i < num; i++){
+        PyObject* item = PySequence_GetItem(list, i);
+        push(L, item);
+        Py_DECREF(item);
+        lua_rawseti(L, -2, i+1);
+    }
+    Py_DECREF(list);
+    lua_setfield(L, -2, list_name);
+    // stack: [..., {table packet}]
+}
+
+// Render commands are buffered per group during get_output and sent to the python renderer once per tick,
+// groups that didn't change since the last tick are not sent again.
+
+enum RenderOp : unsigned char {
+    RENDER_LINE,        // start xyz, end xyz, argb
+    RENDER_RECT_2D,     // x, y, width, height, filled, argb
+    RENDER_RECT_3D,     // location xyz, width, height, filled, argb
+    RENDER_STRING_2D,   // x, y, scale, argb, text
+    RENDER_STRING_3D,   // location xyz, scale, argb, text
+    RENDER_POLYLINE,    // n, n * xyz, argb
+};
+
+struct RenderGroup {
+    std::vector<unsigned char> ops;
+    std::vector<float> values;
+    std::vector<std::string> strings;
+
+    bool operator==(const RenderGroup& other) const {
+        return ops == other.ops && values == other.values && strings == other.strings;
+    }
+};
+
+struct RenderBuffer {
+    std::string group = "default";
+    std::map<std::string, RenderGroup> pending;
+    std::map<std::string, RenderGroup> sent;
+    std::vector<float> scratch;
+};
+
+// Uniform grid over the boost pads from the field info, the pad state is copied in from the packet
+// the first time it's queried in a tick.
+
+#define FIELD_CELL_SIZE 1024.0f
+
+struct IndexedPad {
+    float x, y, z;
+    bool full;
+    float respawn_in;  // 0 when active
+};
+
+struct FieldIndex {
+    std::vector<IndexedPad> pads;
+    std::vector<std::vector<int>> cells;
+    float min_x, min_y;
+    int cols, rows;
+    unsigned long tick;
+    // Query results, kept here so nothing needs freeing if pushing them to Lua raises
+    std::vector<std::pair<float, int>> found;
+};
+
 struct LuaAgent {
     PyObject_HEAD
     PyObject* bot;
     lua_State *L;
+    bool lazy_packet;
+    RenderBuffer* render;
+    FieldIndex* field;
+    PyObject* packet;
+    unsigned long tick;
+    int snapshot;
+    int errors;
+    int max_errors;
 };
 
 static int getBallPrediction(lua_State *L){
@@ -260,289 +487,642 @@ static int getFieldInfo(lua_State *L){
     return 1;
 }
 
-lua_State* createAgent(LuaAgent* agent, int index){
-    lua_State *L = luaL_newstate();
-    luaL_openlibs(L);
+static LuaAgent* getAgent(lua_State *L){
+    // Stack: [Bot, ...]
+    if (lua_type(L, 1) == LUA_TTABLE) {
+        lua_getfield(L, 1, "___agentptr");
+        if (lua_type(L, -1) == LUA_TLIGHTUSERDATA) {
+            auto agent = (LuaAgent*)lua_touserdata(L, -1);
+            lua_pop(L, 1);
+            return agent;
+        }
+    }
+    luaL_argerror(L, 1, "expected bot, call as self:method(...)");
+    return nullptr;
+}
 
-    // Add _G to the stack
-    lua_getglobal(L, "_G");
+static RenderGroup& getRenderGroup(lua_State *L){
+    RenderBuffer* render = getAgent(L)->render;
+    return render->pending[render->group];
+}
 
-    // Register `class` and `super`
-    run_file(L, (char*)"classes.lua", 3);
-    lua_setfield(L, 1, "dump");
-    lua_setfield(L, 1, "super");
-    lua_setfield(L, 1, "class");
-    lua_settop(L, 0);
+static void readVector(lua_State *L, int idx, float* xyz){
+    idx = lua_absindex(L, idx);
+    luaL_checktype(L, idx, LUA_TTABLE);
+    lua_getfield(L, idx, "x");
+    lua_getfield(L, idx, "y");
+    lua_getfield(L, idx, "z");
+    xyz[0] = (float)lua_tonumber(L, -3);
+    xyz[1] = (float)lua_tonumber(L, -2);
+    xyz[2] = (float)lua_tonumber(L, -1);
+    lua_pop(L, 3);
+}
 
-    // Register structs
-    run_file(L, (char*)"structs.lua", 0);
-    // Load bot onto the stack
-    // THIS FILE MUST RETURN AN INSTANCE OR IT WONT WORK!
-    run_file(L, (char*)"bot.lua", 1);
-    lua_pushlightuserdata(L, agent);
-    lua_setfield(L, -2, "___agentptr");
-    lua_pushvalue(L, -1);
+static void readColor(lua_State *L, int idx, float* argb){
+    // Colors are tables with r, g, b and optionally a in 0-255, defaults to white
+    idx = lua_absindex(L, idx);
+    if (!lua_istable(L, idx)) {
+        argb[0] = argb[1] = argb[2] = argb[3] = 255;
+        return;
+    }
+    lua_getfield(L, idx, "a");
+    lua_getfield(L, idx, "r");
+    lua_getfield(L, idx, "g");
+    lua_getfield(L, idx, "b");
+    argb[0] = lua_isnil(L, -4) ? 255 : (float)lua_tonumber(L, -4);
+    argb[1] = (float)lua_tonumber(L, -3);
+    argb[2] = (float)lua_tonumber(L, -2);
+    argb[3] = (float)lua_tonumber(L, -1);
+    lua_pop(L, 4);
+
+    // Clamped so the values sent to create_color are always valid bytes
+    for (int i = 0; i < 4; i++) {
+        if (std::isnan(argb[i])) {
+            luaL_argerror(L, idx, "color channel is NaN");
+        }
+        argb[i] = std::min(std::max(argb[i], 0.0f), 255.0f);
+    }
+}
 
-    lua_pushcfunction(L, getBallPrediction);
-    lua_setfield(L, -2, "get_ball_prediction");
-    lua_pushcfunction(L, getFieldInfo);
-    lua_setfield(L, -2, "get_field_info");
-    // Add methods
+// All arguments are read before anything is added, so a Lua error can't leave half a command in the group
 
-    // Call bot_init
-    lua_getfield(L, -1, "bot_init");
-    lua_insert(L, -2);
-    lua_pushnumber(L, index+1);
-    lua_call(L, 2, 0);
+static void addRenderCommand(lua_State *L, RenderOp op, const float* values, int num){
+    RenderGroup& group = getRenderGroup(L);
+    group.ops.push_back(op);
+    group.values.insert(group.values.end(), values, values+num);
+}
 
-    // Pop _G from the stack
-    return L;
+static int drawLine(lua_State *L){
+    // Stack: [Bot, start, end, color]
+    float values[10];
+    readVector(L, 2, values);
+    readVector(L, 3, values+3);
+    readColor(L, 4, values+6);
+    addRenderCommand(L, RENDER_LINE, values, 10);
+    return 0;
 }
 
-void createLuaPacket(lua_State *L, PyObject* packet){
-    // Get _G for the classes
-    // stack: [Bot, <function get_output>, Bot]
-    lua_getglobal(L, "_G");
-    // stack: [Bot, <function get_output>, Bot, _G]
-    lua_getfield(L, -1, "GameTickPacket");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>]
-    lua_newtable(L);
+static int drawRect(lua_State *L){
+    // Stack: [Bot, x, y, width, height, color, filled] or [Bot, location, width, height, color, filled]
+    float values[10];
+    RenderOp op;
+    int idx, num;
+    if (lua_istable(L, 2)) {
+        op = RENDER_RECT_3D;
+        readVector(L, 2, values);
+        idx = 3;
+        num = 3;
+    } else {
+        op = RENDER_RECT_2D;
+        values[0] = (float)luaL_checknumber(L, 2);
+        values[1] = (float)luaL_checknumber(L, 3);
+        idx = 4;
+        num = 2;
+    }
+    values[num++] = (float)luaL_checknumber(L, idx);
+    values[num++] = (float)luaL_checknumber(L, idx+1);
+    values[num++] = lua_toboolean(L, idx+3) ? 1 : 0;
+    readColor(L, idx+2, values+num);
+    addRenderCommand(L, op, values, num+4);
+    return 0;
+}
+
+static int drawString(lua_State *L){
+    // Stack: [Bot, x, y, text, color, scale] or [Bot, location, text, color, scale]
+    float values[8];
+    RenderOp op;
+    int idx, num;
+    if (lua_istable(L, 2)) {
+        op = RENDER_STRING_3D;
+        readVector(L, 2, values);
+        idx = 3;
+        num = 3;
+    } else {
+        op = RENDER_STRING_2D;
+        values[0] = (float)luaL_checknumber(L, 2);
+        values[1] = (float)luaL_checknumber(L, 3);
+        idx = 4;
+        num = 2;
+    }
+    size_t len;
+    const char* text = luaL_checklstring(L, idx, &len);
+    values[num++] = (float)luaL_optnumber(L, idx+2, 1);
+    readColor(L, idx+1, values+num);
+
+    RenderGroup& group = getRenderGroup(L);
+    group.strings.emplace_back(text, len);
+    group.ops.push_back(op);
+    group.values.insert(group.values.end(), values, values+num+4);
+    return 0;
+}
 
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}]
-    PyObject* num_cars = PyObject_GetAttrString(packet, "num_cars");
-    long num_cars_i = PyLong_AsLong(num_cars);
-    lua_pushinteger(L, num_cars_i);
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {int num_cars}]
-    lua_setfield(L, -2, "num_cars");
-    Py_DECREF(num_cars);
+static void readPolylinePoint(lua_State *L, int points, lua_Integer i, std::vector<float>& scratch){
+    lua_geti(L, points, i);
+    lua_getfield(L, -1, "location");
+    float xyz[3];
+    readVector(L, lua_isnil(L, -1) ? -2 : -1, xyz);
+    scratch.insert(scratch.end(), xyz, xyz+3);
+    lua_pop(L, 2);
+}
 
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}]
-    PyObject* cars = PyObject_GetAttrString(packet, "game_cars");
-    lua_newtable(L);
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table game_cars}]
-    for (long i = 0; i < num_cars_i; i++){
-        // Create car
-        PyObject* index = PyLong_FromLong(i);
-        PyObject* car = PyObject_GetItem(cars, index);
-        Py_DECREF(index);
-        lua_newtable(L);
+static int drawPolyline(lua_State *L){
+    // Stack: [Bot, points, color, step]
+    // points is a list of vectors, a list of objects with a location or a BallPrediction
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer step = luaL_optinteger(L, 4, 1);
+    luaL_argcheck(L, step > 0, 4, "step must be positive");
+    float color[4];
+    readColor(L, 3, color);
+
+    lua_getfield(L, 2, "slices");
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, 2);
+    }
+    // Stack: [Bot, points, color, step, {table points}]
+    int points = lua_gettop(L);
+    lua_Integer num = luaL_len(L, points);
+    if (num < 2) {
+        return 0;
+    }
 
-        // Physics
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table game_cars}, {table car_n}]
-        PyObject* physics = PyObject_GetAttrString(car, "physics");
-        lua_newtable(L);
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table game_cars}, {table car_n}, {table car_n_physics}]
-        char* physics_keys[] = {(char*)"location", (char*)"velocity", (char*)"angular_velocity", (char*)"rotation"};
-
-        for (char* physics_key : physics_keys) {
-            if (strcmp(physics_key, "rotation") == 0){
-                getRotation(L, physics, physics_key);
-            } else {
-                getVector(L, physics, physics_key);
-            }
+    // Points are collected in the agent's scratch buffer, which is only copied into the group once all were read
+    std::vector<float>& scratch = getAgent(L)->render->scratch;
+    scratch.clear();
+    for (lua_Integer i = 1; i <= num; i += step) {
+        readPolylinePoint(L, points, i, scratch);
+    }
+    if ((num - 1) % step != 0) {
+        // Always end on the last point
+        readPolylinePoint(L, points, num, scratch);
+    }
+    if (scratch.size() < 6) {
+        return 0;
+    }
+
+    float count = (float)(scratch.size() / 3);
+    RenderGroup& group = getRenderGroup(L);
+    group.ops.push_back(RENDER_POLYLINE);
+    group.values.push_back(count);
+    group.values.insert(group.values.end(), scratch.begin(), scratch.end());
+    group.values.insert(group.values.end(), color, color+4);
+    return 0;
+}
+
+static int setRenderGroup(lua_State *L){
+    // Stack: [Bot, name]
+    getAgent(L)->render->group = luaL_optstring(L, 2, "default");
+    return 0;
+}
+
+static PyObject* getColor(PyObject* renderer, std::map<unsigned int, PyObject*>& colors, const float* argb){
+    unsigned int key = 0;
+    for (int i = 0; i < 4; i++) {
+        key = (key << 8u) | ((unsigned int)argb[i] & 0xFFu);
+    }
+    auto it = colors.find(key);
+    if (it != colors.end()) {
+        return it->second;
+    }
+    PyObject* color = PyObject_CallMethod(renderer, "create_color", "iiii",
+                                          (int)argb[0], (int)argb[1], (int)argb[2], (int)argb[3]);
+    if (color != nullptr) {
+        colors[key] = color;
+    }
+    return color;
+}
+
+static PyObject* buildVector(const float* xyz){
+    return Py_BuildValue("(ddd)", xyz[0], xyz[1], xyz[2]);
+}
+
+// Returns false if the renderer raised, leaving the error set
+static bool sendRenderGroup(PyObject* renderer, const RenderGroup& group, std::map<unsigned int, PyObject*>& colors){
+    const float* v = group.values.data();
+    size_t text = 0;
+    for (unsigned char op : group.ops) {
+        // Offset of the color and size of the command in values
+        size_t color_offset, size;
+        switch (op) {
+            case RENDER_LINE:       color_offset = 6; size = 10; break;
+            case RENDER_RECT_2D:    color_offset = 5; size = 9; break;
+            case RENDER_RECT_3D:    color_offset = 6; size = 10; break;
+            case RENDER_STRING_2D:  color_offset = 3; size = 7; break;
+            case RENDER_STRING_3D:  color_offset = 4; size = 8; break;
+            case RENDER_POLYLINE:
+                color_offset = 1 + 3 * (size_t)v[0];
+                size = color_offset + 4;
+                break;
+            default:
+                return true;
         }
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table game_cars}, {table car_n}, {table car_n_physics}]
-        lua_setfield(L, -2, "physics");
-        Py_DECREF(physics);
 
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table game_cars}, {table car_n}]
-        char* bool_keys[] = {
-                (char*)"is_demolished",
-                (char*)"has_wheel_contact",
-                (char*)"is_super_sonic",
-                (char*)"is_bot",
-                (char*)"jumped",
-                (char*)"double_jumped"
-        };
-        for (char* key : bool_keys){
-            getBool(L, car, key);
+        PyObject* color = getColor(renderer, colors, v + color_offset);
+        if (color == nullptr) {
+            return false;
+        }
+
+        PyObject* res = nullptr;
+        switch (op) {
+            case RENDER_LINE:
+                res = PyObject_CallMethod(renderer, "draw_line_3d", "NNO",
+                                          buildVector(v), buildVector(v+3), color);
+                break;
+
+            case RENDER_RECT_2D:
+                res = PyObject_CallMethod(renderer, "draw_rect_2d", "iiiiNO",
+                                          (int)v[0], (int)v[1], (int)v[2], (int)v[3],
+                                          PyBool_FromLong(v[4] != 0), color);
+                break;
+
+            case RENDER_RECT_3D:
+                res = PyObject_CallMethod(renderer, "draw_rect_3d", "NiiNO",
+                                          buildVector(v), (int)v[3], (int)v[4],
+                                          PyBool_FromLong(v[5] != 0), color);
+                break;
+
+            case RENDER_STRING_2D:
+                res = PyObject_CallMethod(renderer, "draw_string_2d", "iiiisO",
+                                          (int)v[0], (int)v[1], (int)v[2], (int)v[2],
+                                          group.strings[text++].c_str(), color);
+                break;
+
+            case RENDER_STRING_3D:
+                res = PyObject_CallMethod(renderer, "draw_string_3d", "NiisO",
+                                          buildVector(v), (int)v[3], (int)v[3],
+                                          group.strings[text++].c_str(), color);
+                break;
+
+            case RENDER_POLYLINE: {
+                auto num = (Py_ssize_t)v[0];
+                PyObject* points = PyList_New(num);
+                for (Py_ssize_t i = 0; i < num; i++) {
+                    PyList_SET_ITEM(points, i, buildVector(v + 1 + 3*i));
+                }
+                res = PyObject_CallMethod(renderer, "draw_polyline_3d", "NO", points, color);
+                break;
+            }
+
+            default:
+                break;
         }
 
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table game_cars}, {table car_n}]
-        getString(L, car, (char*)"name");
-        getInt(L, car, (char*)"team");
-        getDouble(L, car, (char*)"boost");
+        if (res == nullptr) {
+            return false;
+        }
+        Py_DECREF(res);
+        v += size;
+    }
+    return true;
+}
 
-        lua_newtable(L);
-        PyObject* hitbox = PyObject_GetAttrString(car, "hitbox");
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table game_cars}, {table car_n}, {table hitbox}]
-        getInt(L, hitbox, (char*)"length");
-        getInt(L, hitbox, (char*)"width");
-        getInt(L, hitbox, (char*)"height");
-
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table game_cars}, {table car_n}, {table hitbox}]
-        lua_setfield(L, -2, "hitbox");
-        Py_DECREF(hitbox);
-
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table game_cars}, {table car_n}]
-        Py_DECREF(car);
-        lua_rawseti(L, -2, i+1);
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table game_cars}]
+void flushRender(LuaAgent* agent){
+    RenderBuffer* render = agent->render;
+    PyObject* renderer = PyObject_GetAttrString(agent->bot, "renderer");
+    if (renderer == nullptr) {
+        PyErr_Clear();
+        render->pending.clear();
+        render->group = "default";
+        return;
     }
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table game_cars}]
-    lua_setfield(L, -2, "game_cars");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}]
 
-    PyObject* num_boost = PyObject_GetAttrString(packet, "num_boost");
-    long num_boost_i = PyLong_AsLong(num_boost);
-    lua_pushinteger(L, num_boost_i);
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {int num_boost}]
-    lua_setfield(L, -2, "num_boost");
-    Py_DECREF(num_boost);
+    // Rendering issues shouldn't stop the bot from playing, errors are printed and the group is retried next tick
 
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}]
-    lua_newtable(L);
-    PyObject* boosts = PyObject_GetAttrString(packet, (char*)"game_boosts");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table boosts}]
-    for (long i = 0; i < num_boost_i; i++) {
-        PyObject* index = PyLong_FromLong(i);
-        PyObject* boost_obj = PyObject_GetItem(boosts, index);
-        Py_DECREF(index);
-        lua_newtable(L);
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table boosts}, {table boost_<i>}]
-        getBool(L, boost_obj, (char*)"is_active");
-        getDouble(L, boost_obj, (char*)"timer");
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table boosts}, {table boost_<i>}]
-        lua_rawseti(L, -2, i+1);
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table boosts}]
-        Py_DECREF(boost_obj);
+    // Clear groups that weren't drawn to this tick
+    for (auto it = render->sent.begin(); it != render->sent.end();) {
+        if (render->pending.count(it->first) != 0) {
+            it++;
+            continue;
+        }
+        PyObject* res = PyObject_CallMethod(renderer, "clear_screen", "s", it->first.c_str());
+        if (res == nullptr) {
+            PyErr_Print();
+            it++;
+            continue;
+        }
+        Py_DECREF(res);
+        it = render->sent.erase(it);
     }
-    Py_DECREF(boosts);
 
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table boosts}]
-    lua_setfield(L, -2, "game_boosts");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}]
+    for (auto& entry : render->pending) {
+        auto sent = render->sent.find(entry.first);
+        if (sent != render->sent.end() && sent->second == entry.second) {
+            continue;
+        }
 
-    lua_newtable(L);
-    PyObject* ball = PyObject_GetAttrString(packet, (char*)"game_ball");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}]
-    PyObject* physics = PyObject_GetAttrString(ball, "physics");
-    lua_newtable(L);
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}, {table physics}]
-    char* physics_keys[] = {(char*)"location", (char*)"velocity", (char*)"angular_velocity", (char*)"rotation"};
+        PyObject* res = PyObject_CallMethod(renderer, "begin_rendering", "s", entry.first.c_str());
+        bool ok = res != nullptr;
+        Py_XDECREF(res);
+
+        // create_color builds into the renderer's current builder, which begin_rendering replaces,
+        // so colors can only be reused within one group
+        std::map<unsigned int, PyObject*> colors;
+        ok = ok && sendRenderGroup(renderer, entry.second, colors);
+        if (ok) {
+            res = PyObject_CallMethod(renderer, "end_rendering", nullptr);
+            ok = res != nullptr;
+            Py_XDECREF(res);
+        }
+        for (auto& color : colors) {
+            Py_DECREF(color.second);
+        }
 
-    for (char* physics_key : physics_keys) {
-        if (strcmp(physics_key, "rotation") == 0){
-            getRotation(L, physics, physics_key);
+        if (ok) {
+            render->sent[entry.first] = std::move(entry.second);
         } else {
-            getVector(L, physics, physics_key);
+            PyErr_Print();
+            // An empty group never equals a drawn one, so this is resent next tick but still cleared when no longer drawn
+            render->sent[entry.first] = RenderGroup();
         }
     }
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}, {table physics}]
-    lua_setfield(L, -2, "physics");
-    Py_DECREF(physics);
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}]
 
-    lua_newtable(L);
-    PyObject* last_touch = PyObject_GetAttrString(ball, "latest_touch");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}, {table last_touch}]
-    getString(L, last_touch, (char*)"player_name");
-    getDouble(L, last_touch, (char*)"time_seconds");
-    getInt(L, last_touch, (char*)"team");
-    getInt(L, last_touch, (char*)"player_index");
-    getVector(L, last_touch, (char*)"hit_location");
-    getVector(L, last_touch, (char*)"hit_normal");
+    Py_DECREF(renderer);
+    render->pending.clear();
+    render->group = "default";
+}
 
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}, {table last_touch}]
-    Py_DECREF(last_touch);
-    lua_setfield(L, -2, "latest_touch");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}]
+static FieldIndex* buildFieldIndex(LuaAgent* agent){
+    PyObject* field_info = PyObject_CallMethod(agent->bot, "get_field_info", nullptr);
+    if (field_info == nullptr) {
+        PyErr_Clear();
+        return nullptr;
+    }
 
-    lua_newtable(L);
-    PyObject* dropshot_info = PyObject_GetAttrString(ball, "drop_shot_info");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}, {table dropshot}]
-    getInt(L, dropshot_info, (char*)"damage_index");
-    getInt(L, dropshot_info, (char*)"absorbed_force");
-    getInt(L, dropshot_info, (char*)"force_accum_recent");
-    Py_DECREF(dropshot_info);
-    lua_setfield(L, -2, "drop_shot_info");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}]
+    auto field = new FieldIndex();
+    long num_boosts = getLength(field_info, "num_boosts");
+    PyObject* boosts = PyObject_GetAttrString(field_info, "boost_pads");
+    for (long i = 0; i < num_boosts; i++) {
+        PyObject* boost = PySequence_GetItem(boosts, i);
+        PyObject* location = PyObject_GetAttrString(boost, "location");
+        PyObject* coord;
+        IndexedPad pad{};
+        coord = PyObject_GetAttrString(location, "x");
+        pad.x = (float)PyFloat_AsDouble(coord);
+        Py_DECREF(coord);
+        coord = PyObject_GetAttrString(location, "y");
+        pad.y = (float)PyFloat_AsDouble(coord);
+        Py_DECREF(coord);
+        coord = PyObject_GetAttrString(location, "z");
+        pad.z = (float)PyFloat_AsDouble(coord);
+        Py_DECREF(coord);
+        PyObject* full = PyObject_GetAttrString(boost, "is_full_boost");
+        pad.full = PyObject_IsTrue(full);
+        Py_DECREF(full);
+        Py_DECREF(location);
+        Py_DECREF(boost);
+        field->pads.push_back(pad);
+    }
+    Py_DECREF(boosts);
+    Py_DECREF(field_info);
 
-    lua_newtable(L);
-    PyObject* collision = PyObject_GetAttrString(ball, "collision_shape");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}, {table collision}]
-    getInt(L, collision, (char*)"type");
+    if (field->pads.empty()) {
+        // Field info isn't available yet, try again on the next query
+        delete field;
+        return nullptr;
+    }
 
-    lua_newtable(L);
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}, {table collision}, {table box}]
-    PyObject* box = PyObject_GetAttrString(collision, (char*)"box");
-    getDouble(L, box, (char*)"length");
-    getDouble(L, box, (char*)"width");
-    getDouble(L, box, (char*)"height");
-    Py_DECREF(box);
-    lua_setfield(L, -2, "box");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}, {table collision}]
+    float max_x = field->pads[0].x, max_y = field->pads[0].y;
+    field->min_x = max_x;
+    field->min_y = max_y;
+    for (const IndexedPad& pad : field->pads) {
+        field->min_x = std::min(field->min_x, pad.x);
+        field->min_y = std::min(field->min_y, pad.y);
+        max_x = std::max(max_x, pad.x);
+        max_y = std::max(max_y, pad.y);
+    }
+    field->cols = (int)((max_x - field->min_x) / FIELD_CELL_SIZE) + 1;
+    field->rows = (int)((max_y - field->min_y) / FIELD_CELL_SIZE) + 1;
+    field->cells.resize(field->cols * field->rows);
+    for (int i = 0; i < (int)field->pads.size(); i++) {
+        int col = (int)((field->pads[i].x - field->min_x) / FIELD_CELL_SIZE);
+        int row = (int)((field->pads[i].y - field->min_y) / FIELD_CELL_SIZE);
+        field->cells[row * field->cols + col].push_back(i);
+    }
+    field->tick = agent->tick - 1;
+    return field;
+}
 
-    lua_newtable(L);
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}, {table collision}, {table sphere}]
-    PyObject* sphere = PyObject_GetAttrString(collision, (char*)"sphere");
-    getDouble(L, sphere, (char*)"diameter");
-    Py_DECREF(sphere);
-    lua_setfield(L, -2, "sphere");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}, {table collision}]
+static FieldIndex* getFieldIndex(LuaAgent* agent){
+    if (agent->field == nullptr) {
+        agent->field = buildFieldIndex(agent);
+        if (agent->field == nullptr) {
+            return nullptr;
+        }
+    }
 
-    lua_newtable(L);
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}, {table collision}, {table cylinder}]
-    PyObject* cylinder = PyObject_GetAttrString(collision, (char*)"cylinder");
-    getDouble(L, cylinder, (char*)"diameter");
-    getDouble(L, cylinder, (char*)"height");
-    Py_DECREF(cylinder);
-    lua_setfield(L, -2, "cylinder");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}, {table collision}]
-    Py_DECREF(collision);
-    lua_setfield(L, -2, "collision_shape");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table ball}]
+    FieldIndex* field = agent->field;
+    if (field->tick == agent->tick || agent->packet == nullptr) {
+        return field;
+    }
+    field->tick = agent->tick;
+
+    PyObject* boosts = PyObject_GetAttrString(agent->packet, "game_boosts");
+    long num_boost = std::min(getLength(agent->packet, "num_boost"), (long)field->pads.size());
+    for (long i = 0; i < num_boost; i++) {
+        PyObject* boost = PySequence_GetItem(boosts, i);
+        PyObject* is_active = PyObject_GetAttrString(boost, "is_active");
+        PyObject* timer = PyObject_GetAttrString(boost, "timer");
+        IndexedPad& pad = field->pads[i];
+        if (PyObject_IsTrue(is_active)) {
+            pad.respawn_in = 0;
+        } else {
+            // timer counts up from when the pad was picked up
+            float respawn = pad.full ? 10.0f : 4.0f;
+            pad.respawn_in = std::max(0.001f, respawn - (float)PyFloat_AsDouble(timer));
+        }
+        Py_DECREF(timer);
+        Py_DECREF(is_active);
+        Py_DECREF(boost);
+    }
+    Py_DECREF(boosts);
+    return field;
+}
 
-    lua_setfield(L, -2, "game_ball");
-    Py_DECREF(ball);
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}]
+struct PadFilter {
+    bool full_only;
+    float eta;
 
-    lua_newtable(L);
-    PyObject* game_info = PyObject_GetAttrString(packet, (char*)"game_info");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table game_info}]
-    getDouble(L, game_info, (char*)"seconds_elapsed");
-    getDouble(L, game_info, (char*)"game_time_remaining");
-    getDouble(L, game_info, (char*)"world_gravity_z");
-    getDouble(L, game_info, (char*)"game_speed");
-    getBool(L, game_info, (char*)"is_overtime");
-    getBool(L, game_info, (char*)"is_unlimited_time");
-    getBool(L, game_info, (char*)"is_round_active");
-    getBool(L, game_info, (char*)"is_kickoff_pause");
-    getBool(L, game_info, (char*)"is_match_ended");
+    bool operator()(const IndexedPad& pad) const {
+        return (!full_only || pad.full) && pad.respawn_in <= eta;
+    }
+};
 
-    Py_DECREF(game_info);
-    lua_setfield(L, -2, "game_info");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}]
+static PadFilter readPadFilter(lua_State *L, int idx){
+    // Pads are only returned when active, or when they respawn within eta seconds
+    return PadFilter{(bool)lua_toboolean(L, idx), (float)luaL_optnumber(L, idx+1, 0)};
+}
 
-    PyObject* num_teams = PyObject_GetAttrString(packet, "num_teams");
-    long num_teams_i = PyLong_AsLong(num_cars);
-    lua_pushinteger(L, num_teams_i);
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {int num_teams}]
-    lua_setfield(L, -2, "num_teams");
-    Py_DECREF(num_teams);
+static float padDistance2(const IndexedPad& pad, const float* point){
+    float dx = pad.x - point[0], dy = pad.y - point[1], dz = pad.z - point[2];
+    return dx*dx + dy*dy + dz*dz;
+}
 
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}]
-    lua_newtable(L);
-    PyObject* teams = PyObject_GetAttrString(packet, "teams");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table teams}]
+static int fieldCol(const FieldIndex* field, float x){
+    return std::min(std::max((int)std::floor((x - field->min_x) / FIELD_CELL_SIZE), 0), field->cols - 1);
+}
 
-    for (long i = 0; i < num_teams_i; i++){
-        PyObject* index = PyLong_FromLong(i);
-        PyObject* team = PyObject_GetItem(teams, index);
-        Py_DECREF(index);
-        lua_newtable(L);
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table teams}, {table team_n}]
+static int fieldRow(const FieldIndex* field, float y){
+    return std::min(std::max((int)std::floor((y - field->min_y) / FIELD_CELL_SIZE), 0), field->rows - 1);
+}
 
-        getInt(L, team, (char*)"team_index");
-        getInt(L, team, (char*)"score");
+// Pushes a table with the 1-based indices of the (sort key, pad) pairs in field->found in order
+static int pushPadIndices(lua_State *L, FieldIndex* field){
+    if (field == nullptr) {
+        lua_newtable(L);
+        return 1;
+    }
+    std::vector<std::pair<float, int>>& found = field->found;
+    std::sort(found.begin(), found.end());
+    lua_createtable(L, (int)found.size(), 0);
+    for (size_t i = 0; i < found.size(); i++) {
+        lua_pushinteger(L, found[i].second + 1);
         lua_rawseti(L, -2, i+1);
-        // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table teams}]
-        Py_DECREF(team);
     }
-    Py_DECREF(teams);
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}, {table teams}]
-    lua_setfield(L, -2, "teams");
-    // stack: [Bot, <function get_output>, Bot, <class GameTickPacket>, {table packet}]
+    return 1;
+}
+
+static int nearestBoostPad(lua_State *L){
+    // Stack: [Bot, location, full_only, eta]
+    LuaAgent* agent = getAgent(L);
+    float point[3];
+    readVector(L, 2, point);
+    PadFilter filter = readPadFilter(L, 3);
+    FieldIndex* field = getFieldIndex(agent);
+    if (field == nullptr) {
+        return 0;
+    }
+
+    int col = fieldCol(field, point[0]), row = fieldRow(field, point[1]);
+    int best = -1;
+    float best_d2 = 0;
+    int max_ring = std::max(field->cols, field->rows);
+    for (int ring = 0; ring <= max_ring; ring++) {
+        for (int r = row - ring; r <= row + ring; r++) {
+            for (int c = col - ring; c <= col + ring; c++) {
+                if (r < 0 || c < 0 || r >= field->rows || c >= field->cols) continue;
+                if (std::abs(r - row) != ring && std::abs(c - col) != ring) continue;
+                for (int i : field->cells[r * field->cols + c]) {
+                    if (!filter(field->pads[i])) continue;
+                    float d2 = padDistance2(field->pads[i], point);
+                    if (best == -1 || d2 < best_d2) {
+                        best = i;
+                        best_d2 = d2;
+                    }
+                }
+            }
+        }
+        // Pads in the next ring are at least this far away
+        float bound = ring * FIELD_CELL_SIZE;
+        if (best != -1 && best_d2 <= bound * bound) {
+            break;
+        }
+    }
+
+    if (best == -1) {
+        return 0;
+    }
+    lua_pushinteger(L, best + 1);
+    lua_pushnumber(L, std::sqrt(best_d2));
+    return 2;
+}
+
+static int boostPadsInRadius(lua_State *L){
+    // Stack: [Bot, location, radius, full_only, eta]
+    LuaAgent* agent = getAgent(L);
+    float point[3];
+    readVector(L, 2, point);
+    auto radius = (float)luaL_checknumber(L, 3);
+    PadFilter filter = readPadFilter(L, 4);
+    FieldIndex* field = getFieldIndex(agent);
+
+    if (field != nullptr) {
+        field->found.clear();
+        for (int r = fieldRow(field, point[1] - radius); r <= fieldRow(field, point[1] + radius); r++) {
+            for (int c = fieldCol(field, point[0] - radius); c <= fieldCol(field, point[0] + radius); c++) {
+                for (int i : field->cells[r * field->cols + c]) {
+                    float d2 = padDistance2(field->pads[i], point);
+                    if (d2 <= radius * radius && filter(field->pads[i])) {
+                        field->found.emplace_back(d2, i);
+                    }
+                }
+            }
+        }
+    }
+    return pushPadIndices(L, field);
+}
+
+static int boostPadsAlongSegment(lua_State *L){
+    // Stack: [Bot, start, end, width, full_only, eta]
+    LuaAgent* agent = getAgent(L);
+    float segment[6];
+    readVector(L, 2, segment);
+    readVector(L, 3, segment+3);
+    auto width = (float)luaL_checknumber(L, 4);
+    PadFilter filter = readPadFilter(L, 5);
+    FieldIndex* field = getFieldIndex(agent);
+
+    const float* a = segment;
+    float d[3] = {segment[3] - a[0], segment[4] - a[1], segment[5] - a[2]};
+    float length2 = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+
+    if (field != nullptr) {
+        field->found.clear();
+        int min_row = fieldRow(field, std::min(a[1], segment[4]) - width);
+        int max_row = fieldRow(field, std::max(a[1], segment[4]) + width);
+        int min_col = fieldCol(field, std::min(a[0], segment[3]) - width);
+        int max_col = fieldCol(field, std::max(a[0], segment[3]) + width);
+        for (int r = min_row; r <= max_row; r++) {
+            for (int c = min_col; c <= max_col; c++) {
+                for (int i : field->cells[r * field->cols + c]) {
+                    const IndexedPad& pad = field->pads[i];
+                    if (!filter(pad)) continue;
+                    // Closest point on the segment, sorted by how far along the segment it is
+                    float t = 0;
+                    if (length2 > 0) {
+                        t = ((pad.x - a[0])*d[0] + (pad.y - a[1])*d[1] + (pad.z - a[2])*d[2]) / length2;
+                        t = std::min(std::max(t, 0.0f), 1.0f);
+                    }
+                    float closest[3] = {a[0] + d[0]*t, a[1] + d[1]*t, a[2] + d[2]*t};
+                    if (padDistance2(pad, closest) <= width * width) {
+                        field->found.emplace_back(t, i);
+                    }
+                }
+            }
+        }
+    }
+    return pushPadIndices(L, field);
+}
+
+void createLuaPacket(lua_State *L, PyObject* packet){
+    // Get _G for the classes
+    // stack: [Bot, <function get_output>, Bot]
+    lua_getglobal(L, "_G");
+    // stack: [Bot, <function get_output>, Bot, _G]
+    lua_getfield(L, -1, "GameTickPacket");
+    // stack: [Bot, <function get_output>, Bot, _G, <class GameTickPacket>]
+    lua_newtable(L);
+    // stack: [Bot, <function get_output>, Bot, _G, <class GameTickPacket>, {table packet}]
+
+    getList(L, packet, "game_cars", "num_cars", pushCar);
+    getList(L, packet, "game_boosts", "num_boost", pushBoost);
+    getList(L, packet, "teams", "num_teams", pushTeam);
+
+    PyObject* ball = PyObject_GetAttrString(packet, (char*)"game_ball");
+    lua_newtable(L);
+    // stack: [Bot, <function get_output>, Bot, _G, <class GameTickPacket>, {table packet}, {table ball}]
+    getPhysics(L, ball, (char*)"physics");
+    getLatestTouch(L, ball);
+    getDropShotInfo(L, ball);
+    getCollisionShape(L, ball);
+    Py_DECREF(ball);
+    lua_setfield(L, -2, "game_ball");
+    // stack: [Bot, <function get_output>, Bot, _G, <class GameTickPacket>, {table packet}]
+
+    PyObject* game_info = PyObject_GetAttrString(packet, (char*)"game_info");
+    pushGameInfo(L, game_info);
+    Py_DECREF(game_info);
+    lua_setfield(L, -2, "game_info");
+    // stack: [Bot, <function get_output>, Bot, _G, <class GameTickPacket>, {table packet}]
 
     // Packet is now on top the stack
 
@@ -554,6 +1134,462 @@ void createLuaPacket(lua_State *L, PyObject* packet){
     // stack: [Bot, <function get_output>, Bot, <object GameTickPacket>]
 }
 
+// Lazy packets: the Lua packet is a proxy holding a reference to the python packet,
+// each field is converted and stored on the proxy the first time it is indexed.
+// The reference is released once get_output returns, as RLBot refills the same packet every tick.
+
+#define PACKET_REF "rlbot_lua.PacketRef"
+
+struct PacketRef {
+    PyObject* packet;
+};
+
+static int PacketRef_gc(lua_State *L){
+    auto ref = (PacketRef*)luaL_checkudata(L, 1, PACKET_REF);
+    Py_XDECREF(ref->packet);
+    ref->packet = nullptr;
+    return 0;
+}
+
+struct LazyList {
+    const char* list_name;
+    const char* num_name;
+    const char* class_name;
+    void (*push)(lua_State*, PyObject*);
+};
+
+static const LazyList lazy_lists[] = {
+        {"game_cars", "num_cars", "GameCar", pushCar},
+        {"game_boosts", "num_boost", "GameBoost", pushBoost},
+        {"teams", "num_teams", "Team", pushTeam},
+};
+
+static PyObject* lazyPacket(lua_State *L){
+    PyObject* packet = ((PacketRef*)lua_touserdata(L, lua_upvalueindex(1)))->packet;
+    if (packet == nullptr) {
+        luaL_error(L, "packet accessed after its tick");
+    }
+    return packet;
+}
+
+// Calls the global class `name` with the raw table on top of the stack
+static void wrapObject(lua_State *L, const char* name){
+    lua_getglobal(L, name);
+    lua_insert(L, -2);
+    lua_call(L, 1, 1);
+}
+
+static int LazyList_index(lua_State *L){
+    // Stack: [{table list}, key]
+    // Upvalues: <PacketRef>, <LazyList>, num
+    auto list = (const LazyList*)lua_touserdata(L, lua_upvalueindex(2));
+    int isnum;
+    lua_Integer i = lua_tointegerx(L, 2, &isnum);
+    if (!isnum || i < 1 || i > lua_tointeger(L, lua_upvalueindex(3))) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    PyObject* items = PyObject_GetAttrString(lazyPacket(L), list->list_name);
+    PyObject* item = PySequence_GetItem(items, i-1);
+    Py_DECREF(items);
+    list->push(L, item);
+    Py_DECREF(item);
+    wrapObject(L, list->class_name);
+    // Stack: [{table list}, key, <object item>]
+
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 1, i);
+    return 1;
+}
+
+static int LazyList_len(lua_State *L){
+    lua_pushvalue(L, lua_upvalueindex(3));
+    return 1;
+}
+
+static int LazyBall_index(lua_State *L){
+    // Stack: [<object GameBall>, key]
+    if (lua_type(L, 2) != LUA_TSTRING) {
+        return 0;
+    }
+    const char* key = lua_tostring(L, 2);
+
+    void (*getter)(lua_State*, PyObject*);
+    if (strcmp(key, "drop_shot_info") == 0) {
+        getter = getDropShotInfo;
+    } else if (strcmp(key, "collision_shape") == 0) {
+        getter = getCollisionShape;
+    } else {
+        return 0;
+    }
+
+    PyObject* ball = PyObject_GetAttrString(lazyPacket(L), "game_ball");
+    lua_pushvalue(L, 1);
+    getter(L, ball);
+    Py_DECREF(ball);
+    lua_pop(L, 1);
+    // Stack: [<object GameBall>, key]
+
+    lua_rawget(L, 1);
+    return 1;
+}
+
+static int LazyPacket_index(lua_State *L){
+    // Stack: [{table packet}, key]
+    // Upvalues: <PacketRef>
+    if (lua_type(L, 2) != LUA_TSTRING) {
+        return 0;
+    }
+    const char* key = lua_tostring(L, 2);
+
+    // The python packet is only fetched once the key is known to be a packet field,
+    // class methods keep working after the tick
+    bool found = false;
+    for (const LazyList& list : lazy_lists) {
+        if (strcmp(key, list.num_name) == 0) {
+            lua_pushinteger(L, getLength(lazyPacket(L), list.num_name));
+            found = true;
+            break;
+        }
+        if (strcmp(key, list.list_name) == 0) {
+            lua_newtable(L);
+            lua_newtable(L);
+            // Stack: [{table packet}, key, {table list}, {table list_meta}]
+            lua_pushvalue(L, lua_upvalueindex(1));
+            lua_pushlightuserdata(L, (void*)&list);
+            lua_pushinteger(L, getLength(lazyPacket(L), list.num_name));
+            lua_pushvalue(L, -3);
+            lua_pushvalue(L, -3);
+            lua_pushvalue(L, -3);
+            lua_pushcclosure(L, LazyList_len, 3);
+            lua_setfield(L, -5, "__len");
+            lua_pushcclosure(L, LazyList_index, 3);
+            lua_setfield(L, -2, "__index");
+            lua_setmetatable(L, -2);
+            // Stack: [{table packet}, key, {table list}]
+            found = true;
+            break;
+        }
+    }
+
+    if (!found && strcmp(key, "game_ball") == 0) {
+        PyObject* ball = PyObject_GetAttrString(lazyPacket(L), "game_ball");
+        lua_newtable(L);
+        getPhysics(L, ball, (char*)"physics");
+        getLatestTouch(L, ball);
+        Py_DECREF(ball);
+        wrapObject(L, "GameBall");
+        // Stack: [{table packet}, key, <object GameBall>]
+
+        lua_getmetatable(L, -1);
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushcclosure(L, LazyBall_index, 1);
+        lua_setfield(L, -2, "__index");
+        lua_pop(L, 1);
+        found = true;
+    } else if (!found && strcmp(key, "game_info") == 0) {
+        PyObject* game_info = PyObject_GetAttrString(lazyPacket(L), "game_info");
+        pushGameInfo(L, game_info);
+        Py_DECREF(game_info);
+        wrapObject(L, "GameInfo");
+        found = true;
+    }
+
+    if (!found) {
+        // Not a packet field, look it up on the class instead
+        lua_getglobal(L, "GameTickPacket");
+        lua_getfield(L, -1, key);
+        return 1;
+    }
+
+    // Stack: [{table packet}, key, value]
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 1);
+    return 1;
+}
+
+static int LazyPacket_tostring(lua_State *L){
+    // Same as create_instance, including a __tostring defined on GameTickPacket
+    lua_getglobal(L, "GameTickPacket");
+    lua_getfield(L, -1, "__tostring");
+    if (lua_type(L, -1) == LUA_TFUNCTION) {
+        lua_pushvalue(L, 1);
+        lua_call(L, 1, 1);
+        return 1;
+    }
+    lua_pushfstring(L, "<object \"GameTickPacket\" at %p>", lua_topointer(L, 1));
+    return 1;
+}
+
+// Returns a registry reference to the PacketRef, to be released with releaseLazyLuaPacket
+int createLazyLuaPacket(lua_State *L, PyObject* packet){
+    // stack: [Bot, <function get_output>, Bot]
+    lua_newtable(L);
+    lua_getglobal(L, "GameTickPacket");
+    lua_setfield(L, -2, "__class");
+    // stack: [Bot, <function get_output>, Bot, {table packet}]
+
+    lua_newtable(L);
+    auto ref = (PacketRef*)lua_newuserdata(L, sizeof(PacketRef));
+    ref->packet = packet;
+    Py_INCREF(packet);
+    luaL_setmetatable(L, PACKET_REF);
+    lua_pushvalue(L, -1);
+    int packet_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    // stack: [Bot, <function get_output>, Bot, {table packet}, {table packet_meta}, <PacketRef>]
+    lua_pushcclosure(L, LazyPacket_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, LazyPacket_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_setmetatable(L, -2);
+    // stack: [Bot, <function get_output>, Bot, <object GameTickPacket>]
+    return packet_ref;
+}
+
+void releaseLazyLuaPacket(lua_State *L, int packet_ref){
+    lua_rawgeti(L, LUA_REGISTRYINDEX, packet_ref);
+    auto ref = (PacketRef*)lua_touserdata(L, -1);
+    Py_XDECREF(ref->packet);
+    ref->packet = nullptr;
+    lua_pop(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, packet_ref);
+}
+
+// The bot is snapshotted right after bot_init by deep copying its table graph,
+// resetting copies the snapshot back into the same bot table.
+// _G, tables stored in a global (which includes the classes) and metatables are shared rather than copied.
+// Both run through lua_pcall, so running out of memory fails the reset instead of aborting.
+
+// Pushes a table mapping _G and each table stored in a global to itself, used to seed seen
+static void pushSharedTables(lua_State *L){
+    lua_newtable(L);
+    lua_getglobal(L, "_G");
+    lua_pushvalue(L, -1);
+    lua_pushvalue(L, -1);
+    lua_rawset(L, -4);
+    // Stack: [..., {table seen}, _G]
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        // Stack: [..., {table seen}, _G, key, value]
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            lua_pushvalue(L, -1);
+            lua_rawset(L, -5);
+        } else {
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+    // Stack: [..., {table seen}]
+}
+
+// The copy recurses in C, so nesting is limited like Lua limits nested C calls
+#define COPY_MAX_DEPTH 200
+
+static void copyValue(lua_State *L, int idx, int seen, int depth);
+
+// Copies all fields from the table at src into the table at dst
+static void copyInto(lua_State *L, int src, int dst, int seen, int depth){
+    if (depth > COPY_MAX_DEPTH) {
+        luaL_error(L, "bot state too deeply nested (more than %d tables)", COPY_MAX_DEPTH);
+    }
+    luaL_checkstack(L, 6, "bot state too deeply nested");
+    lua_pushnil(L);
+    while (lua_next(L, src)) {
+        // Stack: [..., key, value]
+        copyValue(L, -2, seen, depth);
+        copyValue(L, -2, seen, depth);
+        // Stack: [..., key, value, key_copy, value_copy]
+        lua_rawset(L, dst);
+        lua_pop(L, 1);
+    }
+}
+
+// Pushes a deep copy of the value at idx, seen maps already copied or shared tables to their copy
+static void copyValue(lua_State *L, int idx, int seen, int depth){
+    idx = lua_absindex(L, idx);
+    if (lua_type(L, idx) != LUA_TTABLE) {
+        lua_pushvalue(L, idx);
+        return;
+    }
+
+    lua_pushvalue(L, idx);
+    if (lua_rawget(L, seen) != LUA_TNIL) {
+        return;
+    }
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    int copy = lua_gettop(L);
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, copy);
+    lua_rawset(L, seen);
+
+    copyInto(L, idx, copy, seen, depth + 1);
+    if (lua_getmetatable(L, idx)) {
+        lua_setmetatable(L, copy);
+    }
+}
+
+static int snapshotBot(lua_State *L){
+    // Stack: [Bot]
+    pushSharedTables(L);
+    lua_newtable(L);
+    // Stack: [Bot, {table seen}, {table snapshot}]
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 3);
+    lua_rawset(L, 2);
+    copyInto(L, 1, 3, 2, 0);
+
+    lua_pushinteger(L, luaL_ref(L, LUA_REGISTRYINDEX));
+    return 1;
+}
+
+static int restoreBot(lua_State *L){
+    // Stack: [Bot, {table snapshot}]
+    pushSharedTables(L);
+    lua_newtable(L);
+    // Stack: [Bot, {table snapshot}, {table seen}, {table fields}]
+    // References to the snapshot itself point back to the bot
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 1);
+    lua_rawset(L, 3);
+    copyInto(L, 2, 4, 3, 0);
+
+    // Everything was copied, only now replace the bot's fields
+    // Assigning to existing fields is allowed while traversing
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, 1);
+    }
+    lua_pushnil(L);
+    while (lua_next(L, 4)) {
+        // Stack: [..., key, value]
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, 1);
+    }
+    return 0;
+}
+
+void snapshotAgent(LuaAgent* agent){
+    lua_State *L = agent->L;
+    // Stack: [Bot]
+    lua_pushcfunction(L, snapshotBot);
+    lua_pushvalue(L, 1);
+    if (lua_pcall(L, 1, 1, 0) != 0) {
+        std::cerr << "Unable to snapshot bot, reset won't be available: " << lua_tostring(L, -1) << std::endl;
+        agent->snapshot = LUA_NOREF;
+    } else {
+        agent->snapshot = (int)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+    // Stack: [Bot]
+}
+
+// Returns false and leaves the bot as it was if the reset fails
+bool resetAgent(LuaAgent* agent, std::string& error){
+    lua_State *L = agent->L;
+    lua_settop(L, 1);
+    // Stack: [Bot]
+    if (agent->snapshot == LUA_NOREF) {
+        error = "no snapshot of the bot was taken";
+        return false;
+    }
+
+    lua_pushcfunction(L, restoreBot);
+    lua_pushvalue(L, 1);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, agent->snapshot);
+    if (lua_pcall(L, 2, 0, 0) != 0) {
+        const char* message = lua_tostring(L, -1);
+        error = message != nullptr ? message : "unknown error";
+        lua_settop(L, 1);
+        return false;
+    }
+    // Stack: [Bot]
+
+    lua_getfield(L, 1, "lazy_packet");
+    agent->lazy_packet = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    agent->render->pending.clear();
+    agent->render->group = "default";
+    agent->errors = 0;
+    return true;
+}
+
+lua_State* createAgent(LuaAgent* agent, int index){
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+
+    // Add _G to the stack
+    lua_getglobal(L, "_G");
+
+    // Register `class` and `super`
+    run_file(L, (char*)"classes.lua", 3);
+    lua_setfield(L, 1, "dump");
+    lua_setfield(L, 1, "super");
+    lua_setfield(L, 1, "class");
+    lua_settop(L, 0);
+
+    // Metatable releasing the python packet held by lazy packets
+    luaL_newmetatable(L, PACKET_REF);
+    lua_pushcfunction(L, PacketRef_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    // Register structs
+    run_file(L, (char*)"structs.lua", 0);
+    // Load bot onto the stack
+    // THIS FILE MUST RETURN AN INSTANCE OR IT WONT WORK!
+    run_file(L, (char*)"bot.lua", 1);
+    lua_pushlightuserdata(L, agent);
+    lua_setfield(L, -2, "___agentptr");
+    lua_pushvalue(L, -1);
+
+    lua_pushcfunction(L, getBallPrediction);
+    lua_setfield(L, -2, "get_ball_prediction");
+    lua_pushcfunction(L, getFieldInfo);
+    lua_setfield(L, -2, "get_field_info");
+    lua_pushcfunction(L, drawLine);
+    lua_setfield(L, -2, "draw_line");
+    lua_pushcfunction(L, drawRect);
+    lua_setfield(L, -2, "draw_rect");
+    lua_pushcfunction(L, drawString);
+    lua_setfield(L, -2, "draw_string");
+    lua_pushcfunction(L, drawPolyline);
+    lua_setfield(L, -2, "draw_polyline");
+    lua_pushcfunction(L, setRenderGroup);
+    lua_setfield(L, -2, "set_render_group");
+    lua_pushcfunction(L, nearestBoostPad);
+    lua_setfield(L, -2, "nearest_boost_pad");
+    lua_pushcfunction(L, boostPadsInRadius);
+    lua_setfield(L, -2, "boost_pads_in_radius");
+    lua_pushcfunction(L, boostPadsAlongSegment);
+    lua_setfield(L, -2, "boost_pads_along_segment");
+    // Add methods
+
+    // Call bot_init
+    lua_getfield(L, -1, "bot_init");
+    lua_insert(L, -2);
+    lua_pushnumber(L, index+1);
+    lua_call(L, 2, 0);
+
+    lua_getfield(L, -1, "lazy_packet");
+    agent->lazy_packet = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    agent->L = L;
+    snapshotAgent(agent);
+
+    // Pop _G from the stack
+    return L;
+}
+
 PyObject* runAgent(LuaAgent* agent, PyObject* packet) {
     lua_State *L = agent->L;
 
@@ -565,16 +1601,40 @@ PyObject* runAgent(LuaAgent* agent, PyObject* packet) {
     lua_insert(L, -2);
 
     // Parse and prepare packet
-    createLuaPacket(L, packet);
+    int packet_ref = LUA_NOREF;
+    if (agent->lazy_packet) {
+        packet_ref = createLazyLuaPacket(L, packet);
+    } else {
+        createLuaPacket(L, packet);
+    }
     // stack: [Bot, <function get_output>, Bot, <object GameTickPacket>]
 
     // Call function, puts controller state to the stack
+    agent->packet = packet;
+    agent->tick++;
     int res = lua_pcall(L, 2, 1, 0);
+    agent->packet = nullptr;
+    if (packet_ref != LUA_NOREF) {
+        releaseLazyLuaPacket(L, packet_ref);
+    }
     if (res != 0) {
-        PyErr_SetString(PyExc_RuntimeError, lua_tostring(L, -1));
+        const char* message = lua_tostring(L, -1);
+        std::string error = message != nullptr ? message : "unknown error";
         lua_settop(L, 1);
+        // Drop whatever was drawn before the error
+        agent->render->pending.clear();
+        agent->render->group = "default";
+
+        if (agent->max_errors > 0 && ++agent->errors >= agent->max_errors) {
+            std::string reset_error;
+            if (!resetAgent(agent, reset_error)) {
+                error += " (automatic reset failed: " + reset_error + ")";
+            }
+        }
+        PyErr_SetString(PyExc_RuntimeError, error.c_str());
         return nullptr;
     }
+    agent->errors = 0;
     // stack: [Bot, <object ControllerState>]
 
     // Get properties from controller state
@@ -610,6 +1670,8 @@ PyObject* runAgent(LuaAgent* agent, PyObject* packet) {
     // Pop controller state
     lua_pop(L, 1);
     // stack: [Bot]
+
+    flushRender(agent);
     return ret;
 }
 
@@ -617,14 +1679,17 @@ static int Agent_tp_init(PyObject *_self, PyObject *args, PyObject *kwargs) {
     auto* self = (LuaAgent*)_self;
 
     int index;
+    int max_errors = 0;
     PyObject* bot = nullptr;
-    char* kwlist[] = {(char*)"bot", (char*)"index", nullptr};
+    char* kwlist[] = {(char*)"bot", (char*)"index", (char*)"max_errors", nullptr};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi:__init__", kwlist, &bot, &index)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|i:__init__", kwlist, &bot, &index, &max_errors)) {
         return -1;
     }
 
     self->bot = bot;
+    self->max_errors = max_errors;
+    self->render = new RenderBuffer();
     self->L = createAgent(self, index);
     return 0;
 }
@@ -643,17 +1708,30 @@ PyObject* Agent_GetOutput(PyObject *_self, PyObject *args, PyObject *kwargs){
     return runAgent(self, packet);
 }
 
+PyObject* Agent_Reset(PyObject *_self, PyObject *args){
+    auto* self = (LuaAgent*)_self;
+    std::string error;
+    if (!resetAgent(self, error)) {
+        PyErr_Format(PyExc_RuntimeError, "Unable to reset bot: %s", error.c_str());
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
 static int Agent_tp_clear(PyObject *self) {
     return 0;
 }
 
 static void Agent_tp_dealloc(PyObject *self) {
     Agent_tp_clear(self);
+    delete ((LuaAgent*)self)->render;
+    delete ((LuaAgent*)self)->field;
     Py_TYPE(self)->tp_free(self);
 }
 
 PyMethodDef Agent_Methods[] = {
         {"get_output", (PyCFunction) Agent_GetOutput, METH_VARARGS | METH_KEYWORDS, "Returns a controller state from a GTP"},
+        {"reset", (PyCFunction) Agent_Reset, METH_NOARGS, "Restores the bot to its state right after bot_init"},
         {nullptr}
 };
 
@@ -215,6 +215,15 @@ class "FieldInfo" {
     end
 }
 
+class "Color" {
+    __ctr = function(self, r, g, b, a)
+        self.r = r or 255
+        self.g = g or 255
+        self.b = b or 255
+        self.a = a or 255
+    end
+}
+
 class "ControllerState" {
     __ctr = function(self, throttle, steer, pitch, yaw, roll, jump, boost, handbrake, use_item)
         self.throttle = throttle or 0
@@ -230,6 +239,9 @@ class "ControllerState" {
 }
 
 class "LuaBot" {
+    -- Set to true to only convert the parts of the packet that are actually accessed
+    lazy_packet = false,
+
     bot_init = function(self, index)
         self.index = index
     end,